@@ -0,0 +1,247 @@
+#include "AsyncIO.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+AsyncIO::AsyncIO()
+    : input(), output(), reader(), writer(), running(false), eof(false), backlog(), partial(), wake{-1, -1},
+      pushed(0), popped(0), flushed(0), inputQueued(), inputTaken(), outputQueued(), outputTaken()
+{
+    if(::pipe(wake) == 0) {
+        ::fcntl(wake[0], F_SETFL, O_NONBLOCK);
+        ::fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    } else {
+        wake[0] = wake[1] = -1; // the reader falls back to polling for stop
+    }
+}
+
+AsyncIO::~AsyncIO()
+{
+    stop();
+    if(wake[0] >= 0) {
+        ::close(wake[0]);
+        ::close(wake[1]);
+    }
+}
+
+void AsyncIO::consume(const char* begin, const char* end)
+{
+    while(begin != end) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        if(newline == nullptr) {
+            partial.append(begin, end);
+            break;
+        }
+        partial.append(begin, newline);
+        if(!backlog.empty() || !input.push(partial))
+            backlog.push_back(std::move(partial));
+        partial.clear();
+        begin = newline + 1;
+    }
+}
+
+void AsyncIO::readLoop(bool ended)
+{
+    char buffer[4096];
+    auto room = [this]() { return !input.full() || !running.load(std::memory_order_acquire); };
+    while(!ended && running.load(std::memory_order_acquire)) {
+        // lines the ring had no room for go first, nothing new is read until they are gone
+        if(!backlog.empty()) {
+            if(input.push(backlog.front())) {
+                backlog.pop_front();
+                inputQueued.notify();
+            } else {
+                inputTaken.wait(room);
+            }
+            continue;
+        }
+        // stop writes to the wake pipe, so waiting for input never delays it
+        pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+        int ready = ::poll(fds, 2, wake[0] < 0 ? 50 : -1);
+        if(ready == 0 || (ready < 0 && errno == EINTR))
+            continue;
+        if(ready > 0 && fds[1].revents != 0) {
+            char drain[16];
+            while(::read(wake[0], drain, sizeof(drain)) > 0)
+                ;
+            continue;
+        }
+        ssize_t n = ready < 0 ? -1 : ::read(STDIN_FILENO, buffer, sizeof(buffer));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        consume(buffer, buffer + n);
+        inputQueued.notify();
+    }
+    if(running.load(std::memory_order_acquire)) {
+        // end of input: hand over the unterminated last line like std::getline would
+        if(!partial.empty()) {
+            backlog.push_back(std::move(partial));
+            partial.clear();
+        }
+        while(!backlog.empty() && running.load(std::memory_order_acquire)) {
+            if(input.push(backlog.front())) {
+                backlog.pop_front();
+                inputQueued.notify();
+            } else {
+                inputTaken.wait(room);
+            }
+        }
+        eof.store(true, std::memory_order_release);
+        inputQueued.notify();
+    }
+}
+
+void AsyncIO::writeLoop()
+{
+    std::string s;
+    for(;;) {
+        bool stopping = !running.load(std::memory_order_acquire);
+        if(output.pop(s)) {
+            std::cout << s;
+            ++popped;
+            outputTaken.notify();
+            continue;
+        }
+        std::cout.flush();
+        flushed.store(popped, std::memory_order_release);
+        outputTaken.notify();
+        if(stopping)
+            return;
+        outputQueued.wait([this]() { return !output.empty() || !running.load(std::memory_order_acquire); });
+    }
+}
+
+void AsyncIO::start()
+{
+    if(isRunning())
+        return;
+    // readLine takes eof to mean the ring holds all that is left, which is no longer true once
+    // lines have been moved back to the backlog (getBuffered), so the reader flags it anew
+    bool ended = eof.exchange(false, std::memory_order_acq_rel);
+    running.store(true, std::memory_order_release);
+    reader = std::thread(&AsyncIO::readLoop, this, ended);
+    writer = std::thread(&AsyncIO::writeLoop, this);
+}
+
+void AsyncIO::stop()
+{
+    if(!isRunning())
+        return;
+    running.store(false, std::memory_order_release);
+    outputQueued.notify();
+    inputTaken.notify();
+    if(wake[1] >= 0) {
+        char signal = 0;
+        ssize_t written = ::write(wake[1], &signal, 1);
+        (void)written; // a full pipe already wakes the reader
+    }
+    writer.join();
+    reader.join();
+}
+
+bool AsyncIO::isRunning() const
+{
+    return running.load(std::memory_order_acquire);
+}
+
+void AsyncIO::write(std::string s)
+{
+    if(!isRunning()) {
+        std::cout << s;
+        std::cout.flush();
+        return;
+    }
+    while(!output.push(s))
+        outputTaken.wait([this]() { return !output.full(); });
+    ++pushed;
+    outputQueued.notify();
+}
+
+void AsyncIO::flush()
+{
+    if(!isRunning()) {
+        std::cout.flush();
+        return;
+    }
+    outputTaken.wait([this]() { return flushed.load(std::memory_order_acquire) == pushed; });
+}
+
+void AsyncIO::readLine(std::string& line)
+{
+    while(isRunning()) {
+        if(input.pop(line)) {
+            inputTaken.notify();
+            return;
+        }
+        if(eof.load(std::memory_order_acquire)) {
+            // the reader pushed everything before flagging the end of input
+            if(!input.pop(line))
+                line.clear();
+            return;
+        }
+        inputQueued.wait([this]() { return !input.empty() || eof.load(std::memory_order_acquire); });
+    }
+    // stopped: prefetched input comes first, then more of stdin, read the same way the
+    // reader thread does so that nothing is left behind in a buffer it cannot see
+    char buffer[4096];
+    for(;;) {
+        if(input.pop(line))
+            return;
+        if(!backlog.empty()) {
+            line = std::move(backlog.front());
+            backlog.pop_front();
+            return;
+        }
+        if(eof.load(std::memory_order_acquire)) {
+            line.clear();
+            return;
+        }
+        ssize_t n = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n > 0) {
+            consume(buffer, buffer + n);
+            continue;
+        }
+        // end of input: the unterminated last line is returned like std::getline would
+        if(!partial.empty())
+            backlog.push_back(std::move(partial));
+        partial.clear();
+        eof.store(true, std::memory_order_release);
+    }
+}
+
+void AsyncIO::clear()
+{
+    std::string line;
+    while(input.pop(line))
+        ;
+    backlog.clear();
+    partial.clear();
+    eof.store(false, std::memory_order_release);
+}
+
+void AsyncIO::getBuffered(std::vector<std::string>& lines, std::string& rest)
+{
+    // the ring holds older lines than the backlog; move them over so the order is kept
+    std::deque<std::string> ordered;
+    std::string line;
+    while(input.pop(line))
+        ordered.push_back(std::move(line));
+    ordered.insert(ordered.end(), backlog.begin(), backlog.end());
+    backlog.swap(ordered);
+    lines.assign(backlog.begin(), backlog.end());
+    rest = partial;
+}
+
+void AsyncIO::setBuffered(const std::vector<std::string>& lines, const std::string& rest)
+{
+    clear();
+    backlog.assign(lines.begin(), lines.end());
+    partial = rest;
+}
@@ -0,0 +1,153 @@
+/**
+ * @file AsyncIO.h
+ * Contains the single producer, single consumer ring and the threaded I/O used by XCore's
+ * Show and Ask when asynchronous I/O is enabled.
+ */
+#ifndef _X_ASYNCIO_H_INCLUDE_GUARD
+#define _X_ASYNCIO_H_INCLUDE_GUARD
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Lock-free ring buffer for exactly one producer thread and one consumer thread.
+ * push and pop never block; they fail when the ring is full or empty respectively.
+ */
+template <typename T, std::size_t N>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing capacity must be a power of two");
+    T slots[N];
+    alignas(64) std::atomic<std::size_t> head; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<std::size_t> tail; // next slot to push, written by the producer
+public:
+    SpscRing()
+        : slots(), head(0), tail(0) {}
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(SpscRing&) = delete;
+
+    bool push(T& value)
+    {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == N)
+            return false;
+        slots[t & (N - 1)] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value)
+    {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+            return false;
+        value = std::move(slots[h & (N - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const // consumer side
+    {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+
+    bool full() const // producer side
+    {
+        return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == N;
+    }
+};
+
+/**
+ * Lets a thread sleep until another thread makes a condition true, e.g. a ring non-empty.
+ * notify is a fence and a load while nobody waits, so it can follow every push or pop; the
+ * mutex is only taken to wake a thread that is actually parked.
+ */
+class Parking {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<bool> waiting;
+public:
+    Parking()
+        : mutex(), condition(), waiting(false) {}
+    Parking(const Parking&) = delete;
+    Parking& operator=(Parking&) = delete;
+
+    template <typename Predicate>
+    void wait(Predicate ready)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.store(true, std::memory_order_relaxed);
+        // pairs with the fence in notify: either ready sees the change or notify sees waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        condition.wait(lock, ready);
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            condition.notify_one();
+        }
+    }
+};
+
+/**
+ * Moves blocking stdin/stdout traffic off the interpreter thread.
+ * While running, a reader thread prefetches input lines into one ring and a writer thread
+ * drains output from another, so readLine and write only touch the rings in the common case.
+ * All input is read from the stdin descriptor through this class, whether it is running or
+ * not; std::cin must not be used alongside it, since stdio would buffer input it never sees.
+ * stop flushes all pending output; input that was prefetched but not yet read stays
+ * available to readLine.
+ */
+class AsyncIO {
+    static const std::size_t capacity = 1024;
+    SpscRing<std::string, capacity> input;
+    SpscRing<std::string, capacity> output;
+    std::thread reader;
+    std::thread writer;
+    std::atomic<bool> running;
+    std::atomic<bool> eof;
+    std::deque<std::string> backlog; // reader owned while running: lines the ring had no room for
+    std::string partial;             // reader owned while running: input after the last newline
+    int wake[2];                     // self-pipe that interrupts the reader's poll on stop
+    std::size_t pushed;              // writes queued, producer owned
+    std::size_t popped;              // writes taken by the writer thread, writer owned
+    std::atomic<std::size_t> flushed; // writes that have reached std::cout and been flushed
+    Parking inputQueued;             // readLine waits here for a line or the end of input
+    Parking inputTaken;              // the reader waits here for room in the input ring
+    Parking outputQueued;            // the writer waits here for output or stop
+    Parking outputTaken;             // write and flush wait here for the writer to catch up
+
+    void consume(const char* begin, const char* end); // splits input read from stdin into lines
+    void readLoop(bool ended); // ended: stdin is known to be exhausted, only hand over the backlog
+    void writeLoop();
+public:
+    AsyncIO();
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(AsyncIO&) = delete;
+    ~AsyncIO();
+
+    void start();
+    void stop();
+    bool isRunning() const;
+    void write(std::string s);
+    void flush(); // returns once everything written so far has been flushed to std::cout
+    void readLine(std::string& line); // behaves like std::getline on stdin
+    void clear(); // only while stopped: drops buffered input and forgets the end of input
+
+    // Only while stopped: the input read ahead but not yet asked for, as complete lines
+    // (oldest first) and an unterminated rest. Used to carry it through a checkpoint.
+    void getBuffered(std::vector<std::string>& lines, std::string& rest);
+    void setBuffered(const std::vector<std::string>& lines, const std::string& rest);
+};
+
+#endif // _X_ASYNCIO_H_INCLUDE_GUARD
@@ -1,4 +1,7 @@
 #include "Data.h"
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
 
 namespace Data {
     // Instruction implementation starts here
@@ -82,8 +85,163 @@ namespace Data {
         return name;
     }
 
-    InstructionTable Subroutine::getInstructions() const
+    const InstructionTable& Subroutine::getInstructions() const
     {
         return instructions;
     }
+
+    // Program image implementation starts here
+
+    void writeString(std::ostream& os, const std::string& s)
+    {
+        writeRaw<std::uint32_t>(os, s.size());
+        os.write(s.data(), s.size());
+    }
+
+    bool readString(std::istream& is, std::string& s)
+    {
+        std::uint32_t size;
+        if(!readRaw(is, size))
+            return false;
+        // the length is untrusted: grow only by what the stream actually holds, so a bogus
+        // length fails at the end of the input instead of allocating up to 4 GiB up front
+        char buffer[4096];
+        s.clear();
+        while(size > 0) {
+            std::uint32_t n = std::min<std::uint32_t>(size, sizeof(buffer));
+            if(!is.read(buffer, n))
+                return false;
+            s.append(buffer, n);
+            size -= n;
+        }
+        return true;
+    }
+
+    void writeInstruction(std::ostream& os, const Instruction& ins)
+    {
+        writeRaw<std::uint8_t>(os, ins.getType());
+        switch(ins.getType()) {
+            case Instruction::CharLit:
+                writeRaw(os, boost::get<char>(ins.getValue()));
+                break;
+            case Instruction::IntLit:
+                writeRaw(os, boost::get<int>(ins.getValue()));
+                break;
+            case Instruction::DoubleLit:
+                writeRaw(os, boost::get<double>(ins.getValue()));
+                break;
+            case Instruction::StringLit:
+            case Instruction::Call:
+                writeString(os, boost::get<std::string>(ins.getValue()));
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool readInstruction(std::istream& is, Instruction& ins)
+    {
+        std::uint8_t type;
+        if(!readRaw(is, type))
+            return false;
+        switch(type) {
+            case Instruction::CharLit: {
+                char c;
+                if(!readRaw(is, c))
+                    return false;
+                ins = Instruction(c);
+                return true;
+            }
+            case Instruction::IntLit: {
+                int n;
+                if(!readRaw(is, n))
+                    return false;
+                ins = Instruction(n);
+                return true;
+            }
+            case Instruction::DoubleLit: {
+                double n;
+                if(!readRaw(is, n))
+                    return false;
+                ins = Instruction(n);
+                return true;
+            }
+            case Instruction::StringLit:
+            case Instruction::Call: {
+                std::string s;
+                if(!readString(is, s))
+                    return false;
+                ins = Instruction(s, type == Instruction::Call);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    void writeProgram(std::ostream& os, const SubTable& routines)
+    {
+        writeRaw<std::uint32_t>(os, routines.size());
+        for(Subroutine* sub : routines) {
+            std::int32_t parent = -1;
+            if(sub->hasParent()) {
+                auto pos = std::find(routines.begin(), routines.end(), sub->getParent());
+                parent = pos - routines.begin();
+            }
+            writeRaw(os, parent);
+            writeString(os, sub->getName());
+            const InstructionTable& instructions = sub->getInstructions();
+            writeRaw<std::uint32_t>(os, instructions.size());
+            for(Instruction* ins : instructions)
+                writeInstruction(os, *ins);
+        }
+    }
+
+    bool readProgram(std::istream& is, SubTable& routines)
+    {
+        SubTable result;
+        auto fail = [&]() -> bool
+        {
+            for(Subroutine* sub : result)
+                delete sub;
+            return false;
+        };
+        std::uint32_t count;
+        if(!readRaw(is, count) || count == 0)
+            return false;
+        for(std::uint32_t i = 0; i < count; ++i) {
+            std::int32_t parent;
+            std::string name;
+            if(!readRaw(is, parent) || !readString(is, name))
+                return fail();
+            // parents must precede their children and only the root may lack one
+            if(parent >= static_cast<std::int32_t>(i) || (parent < 0) != (i == 0))
+                return fail();
+            Subroutine* sub = new Subroutine(parent < 0 ? nullptr : result[parent], name);
+            result.push_back(sub);
+            std::uint32_t size;
+            if(!readRaw(is, size))
+                return fail();
+            for(std::uint32_t j = 0; j < size; ++j) {
+                Instruction* ins = new Instruction();
+                sub->addInstruction(ins);
+                if(!readInstruction(is, *ins))
+                    return fail();
+            }
+        }
+        routines.insert(routines.end(), result.begin(), result.end());
+        return true;
+    }
+
+    std::uint64_t hashProgram(const SubTable& routines)
+    {
+        std::ostringstream os;
+        writeProgram(os, routines);
+        std::uint64_t hash = 14695981039346656037ULL;
+        for(unsigned char c : os.str()) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
 }
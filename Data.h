@@ -1,9 +1,11 @@
 #ifndef _X_DATA_H_INCLUDE_GUARD
 #define _X_DATA_H_INCLUDE_GUARD
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <ostream>
+#include <istream>
 #include <stack>
 #include <boost/variant.hpp>
 
@@ -50,9 +52,41 @@ namespace Data {
         bool hasParent() const;
         Subroutine* getParent() const;
         std::string getName() const;
-        InstructionTable getInstructions() const;
+        const InstructionTable& getInstructions() const;
     };
 
+    // A routine being executed, the index of its next instruction and how many more times it
+    // runs once this pass ends (set by Repeat)
+    struct Frame {
+        Subroutine* routine;
+        size_t next;
+        int repeat;
+    };
+    typedef std::vector<Frame> CallStack;
+
+    // Binary program images, as accepted by the persistent Host, and checkpoints.
+    // Values are stored in host byte order; routines are written in table order so that
+    // every parent precedes its children (the root, which has no parent, comes first).
+    template <typename T>
+    void writeRaw(std::ostream& os, const T& value)
+    {
+        os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    bool readRaw(std::istream& is, T& value)
+    {
+        return static_cast<bool>(is.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    void writeString(std::ostream& os, const std::string& s);
+    bool readString(std::istream& is, std::string& s);
+    void writeInstruction(std::ostream& os, const Instruction& ins);
+    bool readInstruction(std::istream& is, Instruction& ins);
+    void writeProgram(std::ostream& os, const SubTable& routines);
+    bool readProgram(std::istream& is, SubTable& routines); // caller owns the routines
+    std::uint64_t hashProgram(const SubTable& routines); // FNV-1a of the writeProgram encoding
+
 }
 
 #endif // _X_DATA_H_INCLUDE_GUARD
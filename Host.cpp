@@ -0,0 +1,141 @@
+#include "Host.h"
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Interpreter.h"
+
+bool readFully(int fd, char* buffer, size_t size)
+{
+    while(size > 0) {
+        ssize_t n = ::read(fd, buffer, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+Host::Host(const std::vector<std::string>& preload)
+    : modules()
+{
+    std::string error;
+    for(const std::string& name : preload) {
+        if(modules.pin(name, error) != CallStatus::Ok)
+            throw std::runtime_error(error);
+    }
+}
+
+void Host::run(const Data::SubTable& program)
+{
+    try {
+        Data::XStack stack;
+        Interpreter x(program, modules, stack);
+        x.interpret();
+    } catch(const std::exception& e) {
+        std::cerr << "Error while hosting:\n"
+                  << e.what() << std::endl;
+    }
+    modules.rollback(); // Includes and Excludes do not outlive the program
+    modules.reset();
+}
+
+void Host::serve(int fd)
+{
+    if(fd != STDIN_FILENO) {
+        receive(fd);
+        return;
+    }
+    // the images are read from a private copy of stdin and the programs get /dev/null
+    int images = ::fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    int empty = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(images < 0 || empty < 0 || ::dup2(empty, STDIN_FILENO) < 0) {
+        std::string error = strerror(errno);
+        if(images >= 0)
+            ::close(images);
+        if(empty >= 0)
+            ::close(empty);
+        throw std::runtime_error("could not detach programs from stdin, error was:\n" + error);
+    }
+    ::close(empty);
+    try {
+        receive(images);
+    } catch(...) {
+        ::dup2(images, STDIN_FILENO);
+        ::close(images);
+        throw;
+    }
+    ::dup2(images, STDIN_FILENO);
+    ::close(images);
+}
+
+void Host::receive(int fd)
+{
+    std::string image;
+    std::uint32_t size;
+    while(readFully(fd, reinterpret_cast<char*>(&size), sizeof(size))) {
+        if(size > max_image_size) {
+            // the framing can no longer be trusted, so the rest of the stream is dropped
+            std::cerr << "Host: rejected program image of " << size << " bytes" << std::endl;
+            return;
+        }
+        image.resize(size);
+        if(size > 0 && !readFully(fd, &image[0], size))
+            break;
+        std::istringstream is(image);
+        Data::SubTable program;
+        try {
+            if(Data::readProgram(is, program))
+                run(program);
+            else
+                std::cerr << "Host: rejected malformed program image" << std::endl;
+        } catch(const std::exception& e) {
+            std::cerr << "Host: rejected program image:\n"
+                      << e.what() << std::endl;
+        }
+        for(Data::Subroutine* sub : program)
+            delete sub;
+    }
+}
+
+void Host::listen(const std::string& path)
+{
+    sockaddr_un address;
+    if(path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("socket path " + path + " is too long");
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+
+    int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0)
+        throw std::runtime_error("could not create socket, error was:\n" + std::string(strerror(errno)));
+    ::unlink(path.c_str());
+    if(::bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+       || ::listen(server, SOMAXCONN) < 0) {
+        std::string error = strerror(errno);
+        ::close(server);
+        throw std::runtime_error("could not listen on " + path + ", error was:\n" + error);
+    }
+    for(;;) {
+        int client = ::accept(server, nullptr, nullptr);
+        if(client < 0) {
+            if(errno == EINTR)
+                continue;
+            std::string error = strerror(errno);
+            ::close(server);
+            throw std::runtime_error("could not accept on " + path + ", error was:\n" + error);
+        }
+        serve(client);
+        ::close(client);
+    }
+}
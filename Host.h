@@ -0,0 +1,38 @@
+#ifndef _X_HOST_H_INCLUDE_GUARD
+#define _X_HOST_H_INCLUDE_GUARD
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Data.h"
+#include "Module.h"
+
+/**
+ * Keeps modules resident and runs many programs in one process.
+ * Each program gets a fresh operand stack and Interpreter; module state is cleared between
+ * runs through the optional reset export instead of unloading and reloading the module.
+ * Preloaded modules cannot be unloaded by a program, and the modules a program Includes
+ * or Excludes are returned to their previous state once it finishes.
+ * Programs are received as length-prefixed images (a uint32 byte count in host byte order,
+ * followed by the Data::writeProgram encoding).
+ */
+class Host {
+    ModuleLoader modules;
+
+    void receive(int fd); // runs the images read from fd
+public:
+    static const std::uint32_t max_image_size = 16 * 1024 * 1024; // larger frames end the stream
+
+    Host(const std::vector<std::string>& preload); // throws std::runtime_error if a module fails to load
+    Host(const Host&) = delete;
+    Host& operator=(Host&) = delete;
+    ~Host() = default;
+
+    void run(const Data::SubTable& program);
+    // Runs images from fd until end of stream. When fd is stdin, the programs read an empty
+    // input instead, since Ask would otherwise consume the images that follow.
+    void serve(int fd);
+    void listen(const std::string& path); // serves clients of a local (Unix) socket, never returns
+};
+
+#endif // _X_HOST_H_INCLUDE_GUARD
@@ -1,7 +1,14 @@
 #include "Interpreter.h"
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
 #include "XAssert.h"
 
+static const char checkpoint_magic[4] = { 'X', 'C', 'K', 'P' };
+static const std::uint32_t checkpoint_version = 1;
+
 // Interpreter private member functions implementation starts here
 
 Data::Subroutine* findChild(Data::SubTable& routines, Data::Subroutine* parent, const std::string& name)
@@ -11,24 +18,17 @@ Data::Subroutine* findChild(Data::SubTable& routines, Data::Subroutine* parent,
         return sub->getParent() == parent && sub->getName() == name;
     };
     auto pos = std::find_if(routines.begin(), routines.end(), predicate);
-    if(pos == routines.end())
-        throw InterpreterException(
-            "could not find routine " + name + " with parent " + parent->getName()
-        );
-    else
-        return *pos;
+    return pos == routines.end() ? nullptr : *pos;
 }
 
 Data::Subroutine* findSubroutine(Data::SubTable& subs, const std::string& name, Data::Subroutine* scope)
 {
-    try {
-        return findChild(subs, scope, name);
-    } catch(const InterpreterException& e) {
-        if(scope->hasParent())
-            return findSubroutine(subs, name, scope->getParent());
-        else
-            throw;
+    for(; scope != nullptr; scope = scope->getParent()) {
+        Data::Subroutine* sub = findChild(subs, scope, name);
+        if(sub != nullptr)
+            return sub;
     }
+    return nullptr;
 }
 
 std::string getCallHead(const std::string& call)
@@ -49,80 +49,252 @@ std::string getCallRest(const std::string& call)
     return call.substr(call.find('.') + 1);
 }
 
-void Interpreter::executeCall(Data::Instruction* instruction)
+CallStatus Interpreter::executeCall(Data::Instruction* instruction, std::string& error)
 {
     X_ASSERT(instruction != nullptr);
     X_ASSERT(instruction->getType() == Data::Instruction::Call);
     std::string name = boost::get<std::string>(instruction->getValue());
-    bool found = true;
-    try {
-        std::string head;
-        std::string tail = name;
-        do {
-            head = getCallHead(tail);
-            tail = getCallTail(tail);
-            current = findSubroutine(routines, head, current);
-        } while(head != tail);
-    } catch(const InterpreterException& e) {
-        found = false;
-    }
-    return found ? execute(current->getInstructions()) : executeLibCall(name);
+    Data::Subroutine* routine = frames.back().routine;
+    std::string head;
+    std::string tail = name;
+    do {
+        head = getCallHead(tail);
+        tail = getCallTail(tail);
+        routine = findSubroutine(routines, head, routine);
+    } while(routine != nullptr && head != tail);
+    if(routine == nullptr)
+        return executeLibCall(name, error);
+    frames.push_back(Data::Frame{routine, 0, 0});
+    return CallStatus::Ok;
 }
 
-void Interpreter::executeLibCall(const std::string& name)
+CallStatus Interpreter::executeLibCall(const std::string& name, std::string& error)
 {
-    if(name == "Include") {
-        Data::Instruction* ins = stack.top();
-        if(ins->getType() != Data::Instruction::StringLit)
-            throw InterpreterException("Import expects string literal as top-most stack element");
-        std::string lib_name = boost::get<std::string>(ins->getValue());
-        modules.load(lib_name);
-    } else if (name == "Exclude") {
+    if(name == "Include" || name == "Exclude" || name == "Checkpoint") {
+        if(stack.empty()) {
+            error = name + " expects a string literal on the stack";
+            return CallStatus::StackUnderflow;
+        }
         Data::Instruction* ins = stack.top();
-        if(ins->getType() != Data::Instruction::StringLit)
-            throw InterpreterException("Export expects string literal as top-most stack element");
-        std::string lib_name = boost::get<std::string>(ins->getValue());
-        modules.unload(lib_name);
-    } else {
-        SharedData data(routines, current, modules);
-        modules.call(getCallHead(name), getCallRest(name), stack, data);
+        if(ins->getType() != Data::Instruction::StringLit) {
+            error = name + " expects string literal as top-most stack element";
+            return CallStatus::TypeMismatch;
+        }
+        std::string argument = boost::get<std::string>(ins->getValue());
+        if(name == "Include")
+            return modules.load(argument, error);
+        if(name == "Exclude")
+            return modules.unload(argument, error);
+        // the path is not part of the state, so it is popped before the checkpoint is taken
+        stack.pop();
+        if(argument.empty()) {
+            error = "Checkpoint expects the path of the file to write";
+            return CallStatus::Error;
+        }
+        modules.requestCheckpoint(argument);
+        return CallStatus::Ok;
     }
+    SharedData data(routines, frames.back().routine, modules, frames);
+    return modules.call(getCallHead(name), getCallRest(name), stack, data, error);
 }
 
-void Interpreter::execute(const Data::InstructionTable& instructions)
+CallStatus Interpreter::execute(std::string& error)
 {
-    for(Data::Instruction* action : instructions) {
+    while(!frames.empty()) {
+        if(modules.checkpointRequested()) {
+            bool on_signal;
+            std::string path = modules.takeCheckpointRequest(on_signal);
+            CallStatus status = checkpoint(path, error);
+            if(status != CallStatus::Ok) {
+                if(!on_signal)
+                    return status;
+                // the program did not ask for this checkpoint, so failing it must not end the job
+                modules.flush();
+                std::cerr << "Checkpoint on signal failed:\n"
+                          << error << std::endl;
+                error.clear();
+            }
+        }
+        Data::Frame& frame = frames.back();
+        const Data::InstructionTable& instructions = frame.routine->getInstructions();
+        if(frame.next == instructions.size()) {
+            if(frame.repeat > 0) {
+                --frame.repeat;
+                frame.next = 0;
+            } else {
+                frames.pop_back();
+            }
+            continue;
+        }
+        Data::Instruction* action = instructions[frame.next++];
         X_ASSERT(action->getType() != Data::Instruction::Undefined);
         if(action->getType() == Data::Instruction::Call) {
-            executeCall(action);
+            CallStatus status = executeCall(action, error);
+            if(status != CallStatus::Ok)
+                return status;
         } else {
             stack.push(action);
         }
     }
+    return CallStatus::Ok;
+}
+
+CallStatus Interpreter::writeCheckpoint(std::ostream& os, std::string& error) const
+{
+    os.write(checkpoint_magic, sizeof(checkpoint_magic));
+    Data::writeRaw(os, checkpoint_version);
+    Data::writeRaw<std::uint64_t>(os, Data::hashProgram(routines));
+    // operand stack, bottom first
+    std::vector<Data::Instruction*> values;
+    values.reserve(stack.size());
+    for(Data::XStack copy = stack; !copy.empty(); copy.pop())
+        values.push_back(copy.top());
+    Data::writeRaw<std::uint32_t>(os, values.size());
+    for(auto it = values.rbegin(); it != values.rend(); ++it)
+        Data::writeInstruction(os, **it);
+    // call frames, outermost first
+    Data::writeRaw<std::uint32_t>(os, frames.size());
+    for(const Data::Frame& frame : frames) {
+        auto pos = std::find(routines.begin(), routines.end(), frame.routine);
+        Data::writeRaw<std::uint32_t>(os, pos - routines.begin());
+        Data::writeRaw<std::uint32_t>(os, frame.next);
+        Data::writeRaw<std::int32_t>(os, frame.repeat);
+    }
+    return modules.checkpoint(os, error);
+}
+
+CallStatus Interpreter::readCheckpoint(std::istream& is, std::string& error)
+{
+    char magic[sizeof(checkpoint_magic)];
+    std::uint32_t version;
+    std::uint64_t hash;
+    std::uint32_t count;
+    if(!is.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), checkpoint_magic)
+       || !Data::readRaw(is, version) || version != checkpoint_version) {
+        error = "not a checkpoint of a supported version";
+        return CallStatus::Error;
+    }
+    if(!Data::readRaw(is, hash) || hash != Data::hashProgram(routines)) {
+        error = "checkpoint was taken from a different program";
+        return CallStatus::Error;
+    }
+    if(!Data::readRaw(is, count)) {
+        error = "checkpoint is missing its stack";
+        return CallStatus::Error;
+    }
+    for(std::uint32_t i = 0; i < count; ++i) {
+        // the stack and the modules (e.g. through Variable.Set) outlive this Interpreter
+        Data::Instruction* value = modules.keep(new Data::Instruction());
+        if(!Data::readInstruction(is, *value)) {
+            error = "checkpoint is missing its stack";
+            return CallStatus::Error;
+        }
+        stack.push(value);
+    }
+    if(!Data::readRaw(is, count)) {
+        error = "checkpoint is missing its call frames";
+        return CallStatus::Error;
+    }
+    for(std::uint32_t i = 0; i < count; ++i) {
+        std::uint32_t routine;
+        std::uint32_t next;
+        std::int32_t repeat;
+        if(!Data::readRaw(is, routine) || !Data::readRaw(is, next) || !Data::readRaw(is, repeat)
+           || routine >= routines.size() || next > routines[routine]->getInstructions().size()
+           || repeat < 0) {
+            error = "checkpoint is missing its call frames";
+            return CallStatus::Error;
+        }
+        frames.push_back(Data::Frame{routines[routine], next, repeat});
+    }
+    return modules.restore(is, error);
 }
 
 // Interpreter public member functions implementation starts here
 
-Interpreter::Interpreter(const Data::SubTable& subs, const ModuleLoader& mods, Data::XStack& stack,
+Interpreter::Interpreter(const Data::SubTable& subs, ModuleLoader& mods, Data::XStack& stack,
                          Data::Subroutine* entry)
-    : routines(subs), stack(stack), current(entry), modules(mods)
+    : routines(subs), stack(stack), entry(entry), modules(mods), frames()
 {
 
 }
 
-void Interpreter::interpret()
+CallStatus Interpreter::run(std::string& error)
 {
-    try {
-        if(current == nullptr) {
+    if(frames.empty()) { // otherwise resuming from a checkpoint
+        Data::Subroutine* start = entry;
+        if(start == nullptr) {
+            if(routines.empty()) {
+                error = "program has no routines";
+                return CallStatus::UnknownName;
+            }
             // first routine is always the root
             Data::Subroutine* root = routines.front();
             X_ASSERT(root->hasParent() == false);
-            current = findChild(routines, root, "Main"); // program starts at Main
+            start = findChild(routines, root, "Main"); // program starts at Main
+            if(start == nullptr) {
+                error = "could not find routine Main";
+                return CallStatus::UnknownName;
+            }
         }
-        execute(current->getInstructions());
-    } catch(const InterpreterException& e) {
-        std::cerr << "Error while interpreting:\n"
-                  << e.what() << std::endl;
+        frames.push_back(Data::Frame{start, 0, 0});
     }
+    return execute(error);
+}
 
+void Interpreter::interpret()
+{
+    std::string error;
+    try {
+        if(run(error) == CallStatus::Ok)
+            return;
+    } catch(const std::exception& e) {
+        error = e.what(); // e.g. std::bad_alloc
+    }
+    modules.flush(); // output the program made before failing comes first
+    std::cerr << "Error while interpreting:\n"
+              << error << std::endl;
+}
+
+CallStatus Interpreter::checkpoint(const std::string& path, std::string& error) const
+{
+    if(path.empty()) {
+        error = "no path to write the checkpoint to";
+        return CallStatus::Error;
+    }
+    // written next to the target and renamed, so a crash never leaves half a checkpoint
+    std::string temporary = path + ".tmp";
+    std::ofstream os(temporary, std::ios::binary | std::ios::trunc);
+    if(!os) {
+        error = "could not open " + temporary;
+        return CallStatus::Error;
+    }
+    CallStatus status = writeCheckpoint(os, error);
+    os.close();
+    if(status == CallStatus::Ok && (!os || std::rename(temporary.c_str(), path.c_str()) != 0)) {
+        error = "could not write checkpoint " + path;
+        status = CallStatus::Error;
+    }
+    if(status != CallStatus::Ok)
+        std::remove(temporary.c_str());
+    return status;
+}
+
+CallStatus Interpreter::restore(const std::string& path, std::string& error)
+{
+    X_ASSERT(frames.empty());
+    std::ifstream is(path, std::ios::binary);
+    if(!is) {
+        error = "could not open checkpoint " + path;
+        return CallStatus::Error;
+    }
+    std::size_t depth = stack.size();
+    CallStatus status = readCheckpoint(is, error);
+    if(status != CallStatus::Ok) {
+        // nothing of a checkpoint that failed partway is left for run to resume
+        while(stack.size() > depth)
+            stack.pop();
+        frames.clear();
+    }
+    return status;
 }
@@ -2,6 +2,8 @@
 #define _X_INTERPRETER_H_INCLUDE_GUARD
 
 #include <stdexcept>
+#include <istream>
+#include <ostream>
 #include "Data.h"
 #include "Module.h"
 
@@ -16,6 +18,7 @@ public:
     }
 };
 
+// Both lookups return nullptr when there is no such routine
 Data::Subroutine* findChild(Data::SubTable& routines, Data::Subroutine* parent, const std::string& name);
 
 Data::Subroutine* findSubroutine(Data::SubTable& subs, const std::string& name, Data::Subroutine* scope);
@@ -27,19 +30,32 @@ std::string getCallRest(const std::string& call);
 class Interpreter {
     Data::SubTable routines;
     Data::XStack& stack;
-    Data::Subroutine* current;
-    ModuleLoader modules;
-
-    void executeCall(Data::Instruction* instruction);
-    void executeLibCall(const std::string& name);
-    void execute(const Data::InstructionTable& instructions);
+    Data::Subroutine* entry;
+    ModuleLoader& modules;
+    Data::CallStack frames;
+
+    CallStatus executeCall(Data::Instruction* instruction, std::string& error);
+    CallStatus executeLibCall(const std::string& name, std::string& error);
+    CallStatus execute(std::string& error);
+    CallStatus writeCheckpoint(std::ostream& os, std::string& error) const;
+    CallStatus readCheckpoint(std::istream& is, std::string& error);
 public:
-    Interpreter(const Data::SubTable& subs, const ModuleLoader& mods, Data::XStack& stack,
+    Interpreter(const Data::SubTable& subs, ModuleLoader& mods, Data::XStack& stack,
                 Data::Subroutine* entry = nullptr);
     Interpreter(const Interpreter&) = delete;
     Interpreter& operator=(Interpreter&) = delete;
     ~Interpreter() = default;
-    void interpret();
+    CallStatus run(std::string& error); // leaves reporting errors to the caller
+    void interpret();                    // runs the program and reports any error
+
+    /**
+     * Checkpoints hold the operand stack, the call frames (including the bodies of If and
+     * Repeat and the passes Repeat has left) and the loaded modules together with their state;
+     * restoring one into a fresh Interpreter of the same program makes run resume at the
+     * instruction following the checkpoint.
+     */
+    CallStatus checkpoint(const std::string& path, std::string& error) const;
+    CallStatus restore(const std::string& path, std::string& error);
 };
 
 #endif // _X_INTERPRETER_H_INCLUDE_GUARD
@@ -1,52 +1,212 @@
 #include "Module.h"
-#include <stdexcept>
+#include <cstdint>
+
+// only read by handleSignal, which belongs to the same copy of this code as checkpointOnSignal
+static ModuleLoader* signal_loader = nullptr;
+
+void ModuleLoader::handleSignal(int)
+{
+    if(signal_loader != nullptr)
+        signal_loader->signalled = 1;
+}
 
 ModuleLoader::ModuleLoader()
-    : libs()
+    : libs(), balance(), values(), signalled(0), checkpoint_path(), signal_checkpoint_path()
 {
 
 }
 
 ModuleLoader::~ModuleLoader()
 {
-    for(auto it : libs)
-        unload(it.first);
+    if(signal_loader == this)
+        signal_loader = nullptr;
+    for(auto& it : libs) {
+        ModuleUnload fun = reinterpret_cast<ModuleUnload>(dlsym(it.second.handle, "unload"));
+        (*fun)();
+        dlclose(it.second.handle);
+    }
 }
 
-void ModuleLoader::load(const std::string& name)
+CallStatus ModuleLoader::load(const std::string& name, std::string& error)
 {
+    // modules are reference counted, so a program including an already loaded module
+    // (e.g. one kept resident by a Host) does not reopen it
+    auto lib = libs.find(name);
+    if(lib != libs.end()) {
+        ++lib->second.references;
+        ++balance[name];
+        return CallStatus::Ok;
+    }
     void* handle = dlopen(std::string("./lib" + name + ".so").c_str(), RTLD_LAZY);
-    if(handle == nullptr)
-        throw std::runtime_error(
-            "could not load module " + name + ", error was:\n" + std::string(dlerror())
-        );
-    auto res = libs.insert(
-        std::make_pair(name, handle)
+    if(handle == nullptr) {
+        error = "could not load module " + name + ", error was:\n" + std::string(dlerror());
+        return CallStatus::Error;
+    }
+    ModuleCall call = reinterpret_cast<ModuleCall>(dlsym(handle, "call"));
+    if(call == nullptr) {
+        dlclose(handle);
+        error = "module " + name + " does not export call";
+        return CallStatus::Error;
+    }
+    libs.insert(
+        std::make_pair(name, Module{handle, call, 1, false})
     );
-    if(res.second == false)
-        throw std::runtime_error("module " + name + " already loaded");
+    ++balance[name];
     // call the load function
     ModuleLoad fun = reinterpret_cast<ModuleLoad>(dlsym(handle, "load"));
     (*fun)();
+    return CallStatus::Ok;
 }
 
-void ModuleLoader::unload(const std::string& name)
+CallStatus ModuleLoader::unload(const std::string& name, std::string& error)
 {
     auto lib = libs.find(name);
-    if(lib == libs.end())
-        throw std::runtime_error("module " + name + " cannot be unloaded for it was not loaded");
-    void* handle = lib->second;
-    ModuleUnload fun = reinterpret_cast<ModuleLoad>(dlsym(handle, "unload"));
+    if(lib == libs.end()) {
+        error = "module " + name + " cannot be unloaded for it was not loaded";
+        return CallStatus::UnknownName;
+    }
+    if(lib->second.pinned && lib->second.references == 1) {
+        error = "module " + name + " is kept loaded by the host and cannot be unloaded";
+        return CallStatus::Error;
+    }
+    --balance[name];
+    if(--lib->second.references > 0)
+        return CallStatus::Ok;
+    void* handle = lib->second.handle;
+    ModuleUnload fun = reinterpret_cast<ModuleUnload>(dlsym(handle, "unload"));
     (*fun)();
     dlclose(handle);
+    libs.erase(lib);
+    return CallStatus::Ok;
+}
+
+CallStatus ModuleLoader::pin(const std::string& name, std::string& error)
+{
+    CallStatus status = load(name, error);
+    if(status != CallStatus::Ok)
+        return status;
+    Module& lib = libs[name];
+    if(lib.pinned) // pinning twice keeps a single reference
+        --lib.references;
+    lib.pinned = true;
+    balance.erase(name);
+    return CallStatus::Ok;
+}
+
+void ModuleLoader::rollback()
+{
+    std::map<std::string, int> undo;
+    undo.swap(balance);
+    std::string error;
+    for(auto& it : undo) {
+        for(int i = 0; i < it.second; ++i)
+            unload(it.first, error);
+    }
+    balance.clear();
+}
+
+void ModuleLoader::reset()
+{
+    checkpoint_path.clear(); // a request the finished program did not get to
+    for(auto& it : libs) {
+        ModuleReset fun = reinterpret_cast<ModuleReset>(dlsym(it.second.handle, "reset"));
+        if(fun != nullptr)
+            (*fun)();
+    }
+    values.clear(); // after the modules, which may have referred to them
 }
 
-void ModuleLoader::call(const std::string& lib, const std::string& sub, Data::XStack& stack,
-                         SharedData& d)
+Data::Instruction* ModuleLoader::keep(Data::Instruction* value)
+{
+    values.emplace_back(value);
+    return value;
+}
+
+void ModuleLoader::flush()
+{
+    for(auto& it : libs) {
+        ModuleFlush fun = reinterpret_cast<ModuleFlush>(dlsym(it.second.handle, "flush"));
+        if(fun != nullptr)
+            (*fun)();
+    }
+}
+
+CallStatus ModuleLoader::checkpoint(std::ostream& os, std::string& error) const
+{
+    Data::writeRaw<std::uint32_t>(os, libs.size());
+    for(auto& it : libs) {
+        Data::writeString(os, it.first);
+        ModuleCheckpoint fun = reinterpret_cast<ModuleCheckpoint>(dlsym(it.second.handle, "checkpoint"));
+        Data::writeRaw<std::uint8_t>(os, fun != nullptr);
+        if(fun != nullptr && !(*fun)(os)) {
+            error = "module " + it.first + " could not write its checkpoint";
+            return CallStatus::Error;
+        }
+    }
+    return CallStatus::Ok;
+}
+
+CallStatus ModuleLoader::restore(std::istream& is, std::string& error)
+{
+    std::uint32_t count;
+    if(!Data::readRaw(is, count)) {
+        error = "checkpoint is missing its module list";
+        return CallStatus::Error;
+    }
+    for(std::uint32_t i = 0; i < count; ++i) {
+        std::string name;
+        std::uint8_t has_state;
+        if(!Data::readString(is, name) || !Data::readRaw(is, has_state)) {
+            error = "checkpoint is missing its module list";
+            return CallStatus::Error;
+        }
+        // stands in for the Include that originally loaded the module
+        CallStatus status = load(name, error);
+        if(status != CallStatus::Ok)
+            return status;
+        if(!has_state)
+            continue;
+        ModuleRestore fun = reinterpret_cast<ModuleRestore>(dlsym(libs[name].handle, "restore"));
+        if(fun == nullptr || !(*fun)(is)) {
+            error = "module " + name + " could not restore its checkpoint";
+            return CallStatus::Error;
+        }
+    }
+    return CallStatus::Ok;
+}
+
+CallStatus ModuleLoader::call(const std::string& lib, const std::string& sub, Data::XStack& stack,
+                              SharedData& d, std::string& error)
 {
     auto handle = libs.find(lib);
-    if(handle == libs.end())
-        throw std::runtime_error(sub + " cannot be called for " + lib + " was not loaded");
-    ModuleCall fun = reinterpret_cast<ModuleCall>(dlsym(handle->second, "call"));
-    (*fun)(sub.c_str(), stack, d);
+    if(handle == libs.end()) {
+        error = sub + " cannot be called for " + lib + " was not loaded";
+        return CallStatus::UnknownName;
+    }
+    return (*handle->second.call)(sub.c_str(), stack, d, error);
+}
+
+void ModuleLoader::requestCheckpoint(const std::string& path)
+{
+    checkpoint_path = path;
+}
+
+std::string ModuleLoader::takeCheckpointRequest(bool& on_signal)
+{
+    std::string path;
+    on_signal = checkpoint_path.empty();
+    if(!on_signal) {
+        path.swap(checkpoint_path);
+    } else {
+        signalled = 0;
+        path = signal_checkpoint_path;
+    }
+    return path;
+}
+
+void ModuleLoader::checkpointOnSignal(int signal, const std::string& path)
+{
+    signal_checkpoint_path = path;
+    signal_loader = this;
+    std::signal(signal, handleSignal);
 }
@@ -2,32 +2,83 @@
 #define _X_MODULE_H_INCLUDE_GUARD
 
 #include <dlfcn.h>
+#include <csignal>
 #include <map>
+#include <memory>
+#include <vector>
 #include "Data.h"
 
 class ModuleLoader;
 class SharedData;
+
+// Outcome of a module call. Anything but Ok comes with a message in the error argument.
+enum class CallStatus {
+    Ok,
+    UnknownName,    // no such subroutine, routine or module
+    TypeMismatch,   // an argument had the wrong type
+    StackUnderflow, // not enough arguments on the stack
+    Error
+};
+
 typedef bool (*ModuleLoad)();
 typedef bool (*ModuleUnload)();
-typedef void (*ModuleCall)(const char*, Data::XStack&, SharedData&);
+typedef bool (*ModuleReset)(); // optional, clears per-program state
+typedef bool (*ModuleFlush)(); // optional, writes out buffered output
+typedef bool (*ModuleCheckpoint)(std::ostream&); // optional, writes per-program state
+typedef bool (*ModuleRestore)(std::istream&);    // optional, reads what checkpoint wrote
+typedef CallStatus (*ModuleCall)(const char*, Data::XStack&, SharedData&, std::string&);
 
 class ModuleLoader {
-    std::map<std::string, void*> libs;
+    struct Module {
+        void* handle;
+        ModuleCall call;
+        unsigned int references;
+        bool pinned; // holds one reference that only the destructor gives up
+    };
+    std::map<std::string, Module> libs;
+    std::map<std::string, int> balance; // loads minus unloads since the last rollback
+    std::vector<std::unique_ptr<Data::Instruction>> values; // created by restore, freed on reset
+    // Checkpoint requests live here rather than in the Interpreter, because the loader is the one
+    // object shared by the host and every module, whichever copy of the code handles the request
+    volatile std::sig_atomic_t signalled; // set by the handler installed by checkpointOnSignal
+    std::string checkpoint_path;          // set by the Checkpoint call
+    std::string signal_checkpoint_path;
+
+    static void handleSignal(int signal);
 public:
     ModuleLoader();
+    ModuleLoader(const ModuleLoader&) = delete;
+    ModuleLoader& operator=(ModuleLoader&) = delete;
     ~ModuleLoader();
-    void load(const std::string& name);
-    void unload(const std::string& name);
-    void call(const std::string& lib, const std::string& sub, Data::XStack& stack, SharedData& d);
+    CallStatus load(const std::string& name, std::string& error);
+    CallStatus unload(const std::string& name, std::string& error);
+    CallStatus pin(const std::string& name, std::string& error); // loads, and keeps the module loaded
+    void rollback(); // undoes the loads and unloads made since the last rollback
+    void reset();
+    void flush();
+    Data::Instruction* keep(Data::Instruction* value); // takes ownership until the next reset
+    CallStatus checkpoint(std::ostream& os, std::string& error) const;
+    CallStatus restore(std::istream& is, std::string& error); // loads the modules if necessary
+    CallStatus call(const std::string& lib, const std::string& sub, Data::XStack& stack, SharedData& d,
+                    std::string& error);
+
+    void requestCheckpoint(const std::string& path);
+    bool checkpointRequested() const
+    {
+        return signalled || !checkpoint_path.empty();
+    }
+    // the path to write to, clears the request; on_signal tells a signal from a Checkpoint call
+    std::string takeCheckpointRequest(bool& on_signal);
+    void checkpointOnSignal(int signal, const std::string& path);
 };
 
 struct SharedData {
     Data::SubTable& routines;
     Data::Subroutine* current;
     ModuleLoader& modules;
-    SharedData(Data::SubTable& subs, Data::Subroutine* curr, ModuleLoader& mods)
-        : routines(subs), current(curr), modules(mods) {}
+    Data::CallStack& frames; // a routine pushed here runs right after the call returns
+    SharedData(Data::SubTable& subs, Data::Subroutine* curr, ModuleLoader& mods, Data::CallStack& fs)
+        : routines(subs), current(curr), modules(mods), frames(fs) {}
 };
 
 #endif // _X_MODULE_H_INCLUDE_GUARD
-
@@ -1,94 +1,148 @@
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
 #include <unordered_map>
 #include "Data.h"
 #include "Interpreter.h"
+#include "AsyncIO.h"
+
+CallStatus typeError(const char* fun, std::string& error)
+{
+    error = std::string("argument of incorrect type for ") + fun;
+    return CallStatus::TypeMismatch;
+}
 
 template <typename T>
-T getValue(const Data::Instruction& i, Data::Instruction::Type t, const std::string& fun = "XCore call")
+bool getValue(const Data::Instruction& i, Data::Instruction::Type t, T& value)
 {
     if(i.getType() != t)
-        throw std::runtime_error("argument of incorrect type for " + fun);
-    return boost::get<T>(i.getValue());
+        return false;
+    value = boost::get<T>(i.getValue());
+    return true;
+}
+
+struct Sum {
+    template <typename T> auto operator()(T l, T r) const -> decltype(l + r) { return l + r; }
+};
+struct Difference {
+    template <typename T> auto operator()(T l, T r) const -> decltype(l - r) { return l - r; }
+};
+struct Product {
+    template <typename T> auto operator()(T l, T r) const -> decltype(l * r) { return l * r; }
+};
+struct Quotient {
+    template <typename T> auto operator()(T l, T r) const -> decltype(l / r) { return l / r; }
+};
+
+// applies op to two operands of the same type T
+template <typename T, typename Operation>
+CallStatus apply(const Data::Instruction& left, const Data::Instruction& right, Data::Instruction& result,
+                 Operation op, const char* fun, std::string& error)
+{
+    T l, r;
+    if(!getValue(left, left.getType(), l) || !getValue(right, left.getType(), r))
+        return typeError(fun, error);
+    result = Data::Instruction(op(l, r));
+    return CallStatus::Ok;
 }
 
-Data::Instruction operator+(const Data::Instruction& left, const Data::Instruction& right)
+CallStatus add(const Data::Instruction& left, const Data::Instruction& right, Data::Instruction& result,
+               std::string& error)
 {
-    Data::Instruction::Type t = left.getType();
-    switch(t) {
+    switch(left.getType()) {
         case Data::Instruction::IntLit:
-            return getValue<int>(left, t, "Integer Sum") + getValue<int>(right, t, "Integer Sum");
+            return apply<int>(left, right, result, Sum(), "Integer Sum", error);
         case Data::Instruction::DoubleLit:
-            return getValue<double>(left, t, "Real Sum") + getValue<double>(right, t, "Real Sum");
+            return apply<double>(left, right, result, Sum(), "Real Sum", error);
         case Data::Instruction::CharLit:
-            return getValue<char>(left, t, "Char Sum") + getValue<char>(right, t, "Char Sum");
+            return apply<char>(left, right, result, Sum(), "Char Sum", error);
         case Data::Instruction::StringLit:
-            return getValue<std::string>(left, t, "String Sum")
-                   + getValue<std::string>(right, t, "String Sum");
+            return apply<std::string>(left, right, result, Sum(), "String Sum", error);
         default:
-            throw std::runtime_error("Type does not support XCore summation.");
+            error = "Type does not support XCore summation.";
+            return CallStatus::TypeMismatch;
     }
 }
 
-Data::Instruction operator-(const Data::Instruction& left, const Data::Instruction& right)
+CallStatus subtract(const Data::Instruction& left, const Data::Instruction& right, Data::Instruction& result,
+                    std::string& error)
 {
-    Data::Instruction::Type t = left.getType();
-    switch(t) {
+    switch(left.getType()) {
         case Data::Instruction::IntLit:
-            return getValue<int>(left, t, "Integer Subt") - getValue<int>(right, t, "Integer Subt");
+            return apply<int>(left, right, result, Difference(), "Integer Subt", error);
         case Data::Instruction::DoubleLit:
-            return getValue<double>(left, t, "Real Subt") - getValue<double>(right, t, "Real Subt");
+            return apply<double>(left, right, result, Difference(), "Real Subt", error);
         default:
-            throw std::runtime_error("Type does not support XCore subtraction.");
+            error = "Type does not support XCore subtraction.";
+            return CallStatus::TypeMismatch;
     }
 }
 
-Data::Instruction operator*(const Data::Instruction& left, const Data::Instruction& right)
+CallStatus multiply(const Data::Instruction& left, const Data::Instruction& right, Data::Instruction& result,
+                    std::string& error)
 {
-    Data::Instruction::Type t = left.getType();
-    switch(t) {
+    switch(left.getType()) {
         case Data::Instruction::IntLit:
-            return getValue<int>(left, t, "Integer Mult") * getValue<int>(right, t, "Integer Mult");
+            return apply<int>(left, right, result, Product(), "Integer Mult", error);
         case Data::Instruction::DoubleLit:
-            return getValue<double>(left, t, "Real Mult") * getValue<double>(right, t, "Real Mult");
+            return apply<double>(left, right, result, Product(), "Real Mult", error);
         default:
-            throw std::runtime_error("Type does not support XCore multiplication.");
+            error = "Type does not support XCore multiplication.";
+            return CallStatus::TypeMismatch;
     }
 }
 
-Data::Instruction operator/(const Data::Instruction& left, const Data::Instruction& right)
+CallStatus divide(const Data::Instruction& left, const Data::Instruction& right, Data::Instruction& result,
+                  std::string& error)
 {
-    Data::Instruction::Type t = left.getType();
-    switch(t) {
+    switch(left.getType()) {
         case Data::Instruction::IntLit:
-            return getValue<int>(left, t, "Integer Div") / getValue<int>(right, t, "Integer Div");
+            if(right.getType() == Data::Instruction::IntLit) {
+                int divisor = boost::get<int>(right.getValue());
+                if(divisor == 0) {
+                    error = "Integer Div by zero";
+                    return CallStatus::Error;
+                }
+                // the quotient does not fit an int and traps like a division by zero
+                if(divisor == -1 && boost::get<int>(left.getValue()) == INT_MIN) {
+                    error = "Integer Div overflow";
+                    return CallStatus::Error;
+                }
+            }
+            return apply<int>(left, right, result, Quotient(), "Integer Div", error);
         case Data::Instruction::DoubleLit:
-            return getValue<double>(left, t, "Real Div") / getValue<double>(right, t, "Real Div");
+            return apply<double>(left, right, result, Quotient(), "Real Div", error);
         default:
-            throw std::runtime_error("Type does not support XCore division.");
+            error = "Type does not support XCore division.";
+            return CallStatus::TypeMismatch;
     }
 }
 
 namespace XCore {
-    typedef void (*XFunction) (Data::XStack&, SharedData&);
+    typedef CallStatus (*XFunction) (Data::XStack&, SharedData&, std::string&);
     std::unordered_map<std::string, XFunction> fun_table;
     std::unordered_map<std::string, Data::Instruction*> var_table;
     std::vector<Data::Instruction*> new_instructions; // must be deallocated on unload
+    AsyncIO io; // Show and Ask go through here, threaded between Async.Start and Async.Stop
 
-    Data::Instruction* getStackTop(Data::XStack& stack)
+    // checked before popping, so the getStackTop calls that follow cannot underflow
+    CallStatus requireArguments(Data::XStack& stack, size_t count, const char* fun, std::string& error)
     {
-        Data::Instruction* top = stack.top();
-        stack.pop();
-        return top;
+        if(stack.size() >= count)
+            return CallStatus::Ok;
+        error = std::string("not enough arguments on the stack for ") + fun;
+        return CallStatus::StackUnderflow;
     }
 
-    Data::Instruction* getStackTop(Data::XStack& stack, Data::Instruction::Type t,
-                                   const std::string& fun)
+    Data::Instruction* getStackTop(Data::XStack& stack)
     {
-        Data::Instruction* top = getStackTop(stack);
-        if(top->getType() != t)
-            throw std::runtime_error("argument of incorrect type for " + fun);
+        Data::Instruction* top = stack.top();
+        stack.pop();
         return top;
     }
 
+    // returns nullptr if the name cannot be resolved from parent
     Data::Subroutine* findRoutine(const std::string& name, Data::Subroutine* parent,
                                    Data::SubTable& subs)
     {
@@ -98,148 +152,215 @@ namespace XCore {
         do {
            head = getCallHead(tail);
            tail = getCallTail(tail);
-           current = findSubroutine(subs, head, current); // throws if not found
-        } while(head != tail);
+           current = findSubroutine(subs, head, current);
+        } while(current != nullptr && head != tail);
         return current;
     }
 
-    void x_show(Data::XStack& stack, SharedData&)
+    // pops the condition or count and the routine name shared by If and Repeat
+    CallStatus getControlArguments(Data::XStack& stack, SharedData& data, const char* fun,
+                                   int& value, Data::Subroutine*& routine, std::string& error)
     {
-        std::cout << getStackTop(stack)->getValue();
-        std::cout.flush();
+        CallStatus status = requireArguments(stack, 1, fun, error);
+        if(status != CallStatus::Ok)
+            return status;
+        if(!getValue(*getStackTop(stack), Data::Instruction::IntLit, value))
+            return typeError(fun, error);
+        if(!value)
+            return CallStatus::Ok;
+        status = requireArguments(stack, 1, fun, error);
+        if(status != CallStatus::Ok)
+            return status;
+        std::string to_call;
+        if(!getValue(*getStackTop(stack), Data::Instruction::StringLit, to_call))
+            return typeError(fun, error);
+        routine = findRoutine(to_call, data.current, data.routines);
+        if(routine == nullptr) {
+            error = std::string(fun) + " could not find routine " + to_call;
+            return CallStatus::UnknownName;
+        }
+        return CallStatus::Ok;
     }
 
-    void x_ask(Data::XStack& stack, SharedData&)
+    CallStatus x_show(Data::XStack& stack, SharedData&, std::string& error)
+    {
+        CallStatus status = requireArguments(stack, 1, "Show", error);
+        if(status != CallStatus::Ok)
+            return status;
+        Data::Instruction* top = getStackTop(stack);
+        if(!io.isRunning()) {
+            std::cout << top->getValue();
+            std::cout.flush();
+            return CallStatus::Ok;
+        }
+        std::ostringstream os;
+        os << top->getValue();
+        io.write(os.str());
+        return CallStatus::Ok;
+    }
+
+    CallStatus x_ask(Data::XStack& stack, SharedData&, std::string&)
     {
         std::string line;
-        std::getline(std::cin, line);
+        io.readLine(line);
         Data::Instruction* ins = new Data::Instruction(line);
         new_instructions.push_back(ins);
         stack.push(ins);
+        return CallStatus::Ok;
     }
 
-    void x_pop(Data::XStack& stack, SharedData&)
+    CallStatus x_async_start(Data::XStack&, SharedData&, std::string&)
     {
-        stack.pop();
+        io.start();
+        return CallStatus::Ok;
+    }
+
+    CallStatus x_async_stop(Data::XStack&, SharedData&, std::string&)
+    {
+        io.stop();
+        return CallStatus::Ok;
+    }
+
+    CallStatus x_pop(Data::XStack& stack, SharedData&, std::string& error)
+    {
+        CallStatus status = requireArguments(stack, 1, "Pop", error);
+        if(status == CallStatus::Ok)
+            stack.pop();
+        return status;
     }
 
-    void x_swap(Data::XStack& stack, SharedData&)
+    CallStatus x_swap(Data::XStack& stack, SharedData&, std::string& error)
     {
+        CallStatus status = requireArguments(stack, 2, "Swap", error);
+        if(status != CallStatus::Ok)
+            return status;
         Data::Instruction* first = getStackTop(stack);
         Data::Instruction* second = getStackTop(stack);
         stack.push(first);
         stack.push(second);
+        return CallStatus::Ok;
     }
 
-    void x_duplicate(Data::XStack& stack, SharedData&)
+    CallStatus x_duplicate(Data::XStack& stack, SharedData&, std::string& error)
     {
-        stack.push(stack.top());
+        CallStatus status = requireArguments(stack, 1, "Duplicate", error);
+        if(status == CallStatus::Ok)
+            stack.push(stack.top());
+        return status;
     }
 
-    void x_if(Data::XStack& stack, SharedData& data)
+    CallStatus x_if(Data::XStack& stack, SharedData& data, std::string& error)
     {
-        Data::Instruction* top = getStackTop(stack, Data::Instruction::IntLit, "If");
-        int value = boost::get<int>(top->getValue());
-        if(!value)
-            return;
-        top = getStackTop(stack, Data::Instruction::StringLit, "If");
-        std::string to_call = boost::get<std::string>(top->getValue());
-        Data::Subroutine* routine = findRoutine(to_call, data.current, data.routines);
-        Interpreter x(data.routines, data.modules, stack, routine);
-        x.interpret();
+        int value;
+        Data::Subroutine* routine = nullptr;
+        CallStatus status = getControlArguments(stack, data, "If", value, routine, error);
+        if(status == CallStatus::Ok && value)
+            data.frames.push_back(Data::Frame{routine, 0, 0});
+        return status;
     }
 
-    void x_repeat(Data::XStack& stack, SharedData& data)
+    CallStatus x_repeat(Data::XStack& stack, SharedData& data, std::string& error)
     {
-        Data::Instruction* top = getStackTop(stack, Data::Instruction::IntLit, "Repeat");
-        int value = boost::get<int>(top->getValue());
-        if(!value)
-            return;
-        top = getStackTop(stack, Data::Instruction::StringLit, "Repeat");
-        std::string to_call = boost::get<std::string>(top->getValue());
-        Data::Subroutine* routine = findRoutine(to_call, data.current, data.routines);
-        for(int i = 0; i < value; ++i) {
-            Interpreter x(data.routines, data.modules, stack, routine);
-            x.interpret();
-        }
+        int value;
+        Data::Subroutine* routine = nullptr;
+        CallStatus status = getControlArguments(stack, data, "Repeat", value, routine, error);
+        // the calling Interpreter runs the passes, so they can be checkpointed like any frame
+        if(status == CallStatus::Ok && value > 0)
+            data.frames.push_back(Data::Frame{routine, 0, value - 1});
+        return status;
     }
 
-    void x_add(Data::XStack& stack, SharedData& data)
+    // pops the two operands of a binary operation and pushes its result
+    CallStatus binary(Data::XStack& stack, CallStatus (*op)(const Data::Instruction&, const Data::Instruction&,
+                      Data::Instruction&, std::string&), const char* fun, std::string& error)
     {
+        CallStatus status = requireArguments(stack, 2, fun, error);
+        if(status != CallStatus::Ok)
+            return status;
         Data::Instruction right = *getStackTop(stack);
         Data::Instruction left = *getStackTop(stack);
-        Data::Instruction* ins = new Data::Instruction(left + right);
+        Data::Instruction result;
+        status = (*op)(left, right, result, error);
+        if(status != CallStatus::Ok)
+            return status;
+        Data::Instruction* ins = new Data::Instruction(result);
         new_instructions.push_back(ins);
         stack.push(ins);
+        return CallStatus::Ok;
     }
 
-    void x_sub(Data::XStack& stack, SharedData& data)
+    CallStatus x_add(Data::XStack& stack, SharedData&, std::string& error)
     {
-        Data::Instruction right = *getStackTop(stack);
-        Data::Instruction left = *getStackTop(stack);
-        Data::Instruction* ins = new Data::Instruction(left - right);
-        new_instructions.push_back(ins);
-        stack.push(ins);
+        return binary(stack, add, "Add", error);
     }
 
-    void x_mul(Data::XStack& stack, SharedData&)
+    CallStatus x_sub(Data::XStack& stack, SharedData&, std::string& error)
     {
-        Data::Instruction right = *getStackTop(stack);
-        Data::Instruction left = *getStackTop(stack);
-        Data::Instruction* ins = new Data::Instruction(left * right);
-        new_instructions.push_back(ins);
-        stack.push(ins);
+        return binary(stack, subtract, "Sub", error);
     }
 
-    void x_div(Data::XStack& stack, SharedData&)
+    CallStatus x_mul(Data::XStack& stack, SharedData&, std::string& error)
     {
-        Data::Instruction right = *getStackTop(stack);
-        Data::Instruction left = *getStackTop(stack);
-        Data::Instruction* ins = new Data::Instruction(left / right);
-        new_instructions.push_back(ins);
-        stack.push(ins);
+        return binary(stack, multiply, "Mul", error);
+    }
+
+    CallStatus x_div(Data::XStack& stack, SharedData&, std::string& error)
+    {
+        return binary(stack, divide, "Div", error);
     }
 
-    void x_setvar(Data::XStack& stack, SharedData&)
+    CallStatus x_setvar(Data::XStack& stack, SharedData&, std::string& error)
     {
-        std::string name = getValue<std::string> (
-            *getStackTop(stack), Data::Instruction::StringLit, "Variable.Set"
-        );
+        CallStatus status = requireArguments(stack, 2, "Variable.Set", error);
+        if(status != CallStatus::Ok)
+            return status;
+        std::string name;
+        if(!getValue(*getStackTop(stack), Data::Instruction::StringLit, name))
+            return typeError("Variable.Set", error);
         var_table[name] = getStackTop(stack);
+        return CallStatus::Ok;
     }
 
-    void x_getvar(Data::XStack& stack, SharedData&)
+    CallStatus x_getvar(Data::XStack& stack, SharedData&, std::string& error)
     {
-        std::string name = getValue<std::string>(
-            *getStackTop(stack), Data::Instruction::StringLit, "Variable.Get"
-        );
-        if(var_table.count(name) > 0)
-            stack.push(var_table[name]);
-        else
-            throw std::runtime_error("could not get nonexistant variable " + name);
+        CallStatus status = requireArguments(stack, 1, "Variable.Get", error);
+        if(status != CallStatus::Ok)
+            return status;
+        std::string name;
+        if(!getValue(*getStackTop(stack), Data::Instruction::StringLit, name))
+            return typeError("Variable.Get", error);
+        auto it = var_table.find(name);
+        if(it == var_table.end()) {
+            error = "could not get nonexistant variable " + name;
+            return CallStatus::UnknownName;
+        }
+        stack.push(it->second);
+        return CallStatus::Ok;
     }
 
-    void x_delvar(Data::XStack& stack, SharedData&)
+    CallStatus x_delvar(Data::XStack& stack, SharedData&, std::string& error)
     {
-        std::string name = getValue<std::string>(
-            *getStackTop(stack), Data::Instruction::StringLit, "Variable.Del"
-        );
-        if(var_table.count(name) > 0)
-            var_table.erase(name);
-        else
-            throw std::runtime_error("could not remove nonexistant variable " + name);
+        CallStatus status = requireArguments(stack, 1, "Variable.Del", error);
+        if(status != CallStatus::Ok)
+            return status;
+        std::string name;
+        if(!getValue(*getStackTop(stack), Data::Instruction::StringLit, name))
+            return typeError("Variable.Del", error);
+        if(var_table.erase(name) == 0) {
+            error = "could not remove nonexistant variable " + name;
+            return CallStatus::UnknownName;
+        }
+        return CallStatus::Ok;
     }
 
-    void handleCall(const std::string& s, Data::XStack& stack, SharedData& data)
+    CallStatus handleCall(const std::string& s, Data::XStack& stack, SharedData& data, std::string& error)
     {
         auto it = fun_table.find(s);
-        if(it == fun_table.end())
-            std::cerr << "Unkown subroutine in XCore: " << s << std::endl;
-        try {
-            (*it->second)(stack, data);
-        } catch(std::exception& e) {
-            std::cout << "XCore error:\n" << e.what() << std::endl;
+        if(it == fun_table.end()) {
+            error = "Unkown subroutine in XCore: " + s;
+            return CallStatus::UnknownName;
         }
+        return (*it->second)(stack, data, error);
     }
 
     void registerCalls()
@@ -247,6 +368,8 @@ namespace XCore {
         // IO
         fun_table["Show"] = x_show;
         fun_table["Ask"] = x_ask;
+        fun_table["Async.Start"] = x_async_start;
+        fun_table["Async.Stop"] = x_async_stop;
         // stack operations
         fun_table["Pop"] = x_pop;
         fun_table["Swap"] = x_swap;
@@ -267,10 +390,69 @@ namespace XCore {
 
     void cleanUp()
     {
+        io.stop(); // flushes pending output
         for(Data::Instruction* i : new_instructions) {
             if(i != nullptr)
                 delete i;
         }
+        new_instructions.clear();
+        var_table.clear();
+    }
+
+    bool writeState(std::ostream& os)
+    {
+        // stopping flushes pending output before the checkpoint is in place, and hands over
+        // the input the reader took off stdin, which a restarted process could not read again
+        bool async = io.isRunning();
+        io.stop();
+        std::vector<std::string> lines;
+        std::string rest;
+        io.getBuffered(lines, rest);
+        Data::writeRaw<std::uint8_t>(os, async);
+        Data::writeRaw<std::uint32_t>(os, lines.size());
+        for(const std::string& line : lines)
+            Data::writeString(os, line);
+        Data::writeString(os, rest);
+        Data::writeRaw<std::uint32_t>(os, var_table.size());
+        for(auto& var : var_table) {
+            Data::writeString(os, var.first);
+            Data::writeInstruction(os, *var.second);
+        }
+        if(async)
+            io.start();
+        return static_cast<bool>(os);
+    }
+
+    bool readState(std::istream& is)
+    {
+        std::uint8_t async;
+        std::uint32_t count;
+        if(!Data::readRaw(is, async) || !Data::readRaw(is, count))
+            return false;
+        std::vector<std::string> lines;
+        std::string rest;
+        for(std::uint32_t i = 0; i < count; ++i) {
+            std::string line;
+            if(!Data::readString(is, line))
+                return false;
+            lines.push_back(std::move(line));
+        }
+        if(!Data::readString(is, rest) || !Data::readRaw(is, count))
+            return false;
+        io.stop();
+        io.setBuffered(lines, rest);
+        var_table.clear();
+        for(std::uint32_t i = 0; i < count; ++i) {
+            std::string name;
+            Data::Instruction* ins = new Data::Instruction();
+            new_instructions.push_back(ins);
+            if(!Data::readString(is, name) || !Data::readInstruction(is, *ins))
+                return false;
+            var_table[name] = ins;
+        }
+        if(async)
+            io.start();
+        return true;
     }
 }
 
@@ -288,8 +470,31 @@ extern "C"
         return true;
     }
 
-    void call(const char* s, Data::XStack& stack, SharedData& data)
+    bool reset()
+    {
+        XCore::cleanUp();
+        XCore::io.clear(); // the next program starts with its own input
+        return true;
+    }
+
+    bool flush()
+    {
+        XCore::io.flush();
+        return true;
+    }
+
+    bool checkpoint(std::ostream& os)
+    {
+        return XCore::writeState(os);
+    }
+
+    bool restore(std::istream& is)
+    {
+        return XCore::readState(is);
+    }
+
+    CallStatus call(const char* s, Data::XStack& stack, SharedData& data, std::string& error)
     {
-        XCore::handleCall(s, stack, data);
+        return XCore::handleCall(s, stack, data, error);
     }
 }